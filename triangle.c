@@ -1,7 +1,11 @@
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES2/gl2.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 static const EGLint configAttribs[] = {
@@ -104,12 +108,830 @@ static const char *eglGetErrorStr()
     return "Unknown error!";
 }
 
-int main(int argv, char **argc)
+// Asynchronous shader program manager.
+//
+// Compiling and linking shaders with glCompileShader/glLinkProgram blocks the
+// calling thread until the driver is done. With a handful of programs that is
+// not noticeable, but with dozens of them the render loop stalls. The manager
+// below moves that work off the render thread in one of two ways:
+//
+// 1. If the driver exposes GL_KHR_parallel_shader_compile, the compile and link
+//    calls are issued on the render thread (they return immediately) and the
+//    result is polled with GL_COMPLETION_STATUS_KHR.
+// 2. Otherwise a worker thread with its own EGL context, sharing objects with
+//    the main context, compiles and links the programs.
+//
+// Until a program is ready, programManagerGet() returns a placeholder program
+// so that the render loop can keep drawing something. Compile logs and the
+// compile time of each program are kept and can be printed at any time.
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef void (*MaxShaderCompilerThreadsProc)(GLuint count);
+
+#define MAX_PROGRAMS 64
+#define MAX_LOG_LENGTH 1024
+
+// All programs created by the manager have their "pos" attribute bound to the
+// same location, so the placeholder can be swapped in without any changes to
+// the vertex attribute setup.
+#define POS_ATTRIB_LOCATION 0
+
+enum ProgramState
+{
+    PROGRAM_PENDING,
+    PROGRAM_COMPILING,
+    PROGRAM_READY,
+    PROGRAM_FAILED
+};
+
+struct ProgramEntry
+{
+    const char *vertexCode;
+    const char *fragmentCode;
+    GLuint program;
+    GLuint vert;
+    GLuint frag;
+    enum ProgramState state;
+    double startTime;
+    double queueTime;
+    double compileTime;
+    char log[MAX_LOG_LENGTH];
+};
+
+struct ProgramManager
+{
+    EGLDisplay display;
+    EGLContext workerContext;
+    EGLSurface workerSurface;
+    EGLenum api;
+    int parallelCompile;
+    int hasWorker;
+    int workerFailed;
+    int quit;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ProgramEntry entries[MAX_PROGRAMS];
+    int count;
+    GLuint placeholder;
+};
+
+static const char *placeholderVertexCode = STRINGIFY(
+    attribute vec3 pos; void main() { gl_Position = vec4(pos, 1.0); });
+
+// Placeholder programs are rendered in plain grey
+static const char *placeholderFragmentCode =
+    STRINGIFY(void main() { gl_FragColor = vec4(0.5, 0.5, 0.5, 1.0); });
+
+static double getTimeMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Appends the info log of a shader or a program to the entry log.
+static void appendLog(char *log, GLuint object, int isProgram)
+{
+    size_t used = strlen(log);
+    GLsizei length = 0;
+    if (used + 1 >= MAX_LOG_LENGTH)
+        return;
+
+    if (isProgram)
+        glGetProgramInfoLog(object, MAX_LOG_LENGTH - used, &length, log + used);
+    else
+        glGetShaderInfoLog(object, MAX_LOG_LENGTH - used, &length, log + used);
+    log[used + length] = '\0';
+}
+
+// Issues all compile and link calls for the entry. Does not wait for them.
+// The time spent waiting in the queue until now is kept as queueTime.
+static void startProgram(struct ProgramEntry *entry)
+{
+    double now = getTimeMs();
+    entry->queueTime = now - entry->startTime;
+    entry->startTime = now;
+
+    entry->vert = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(entry->vert, 1, &entry->vertexCode, NULL);
+    glCompileShader(entry->vert);
+    entry->frag = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(entry->frag, 1, &entry->fragmentCode, NULL);
+    glCompileShader(entry->frag);
+    entry->program = glCreateProgram();
+    glAttachShader(entry->program, entry->vert);
+    glAttachShader(entry->program, entry->frag);
+    glBindAttribLocation(entry->program, POS_ATTRIB_LOCATION, "pos");
+    glLinkProgram(entry->program);
+}
+
+// Checks the compile and link status of the entry, collects the logs, and
+// releases the shader objects. Must only be called once the link is complete.
+static enum ProgramState finishProgram(struct ProgramEntry *entry)
+{
+    GLint vertOk, fragOk, linkOk;
+    glGetShaderiv(entry->vert, GL_COMPILE_STATUS, &vertOk);
+    glGetShaderiv(entry->frag, GL_COMPILE_STATUS, &fragOk);
+    glGetProgramiv(entry->program, GL_LINK_STATUS, &linkOk);
+
+    appendLog(entry->log, entry->vert, 0);
+    appendLog(entry->log, entry->frag, 0);
+    appendLog(entry->log, entry->program, 1);
+
+    glDetachShader(entry->program, entry->vert);
+    glDetachShader(entry->program, entry->frag);
+    glDeleteShader(entry->vert);
+    glDeleteShader(entry->frag);
+    entry->vert = entry->frag = 0;
+    entry->compileTime = getTimeMs() - entry->startTime;
+
+    return vertOk && fragOk && linkOk ? PROGRAM_READY : PROGRAM_FAILED;
+}
+
+static void *programManagerWorker(void *arg)
+{
+    struct ProgramManager *pm = (struct ProgramManager *)arg;
+
+    // The rendering API is per thread, so it has to match the main thread.
+    eglBindAPI(pm->api);
+    if (!eglMakeCurrent(pm->display, pm->workerSurface, pm->workerSurface,
+                        pm->workerContext))
+    {
+        fprintf(stderr, "Failed to make shader worker context current! "
+                        "Error: %s\n",
+                eglGetErrorStr());
+        // Pending programs are picked up by the render thread instead
+        pthread_mutex_lock(&pm->lock);
+        pm->workerFailed = 1;
+        pthread_mutex_unlock(&pm->lock);
+        eglReleaseThread();
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pm->lock);
+    while (!pm->quit)
+    {
+        struct ProgramEntry *entry = NULL;
+        for (int i = 0; i < pm->count; i++)
+        {
+            if (pm->entries[i].state == PROGRAM_PENDING)
+            {
+                entry = &pm->entries[i];
+                break;
+            }
+        }
+
+        if (entry == NULL)
+        {
+            pthread_cond_wait(&pm->cond, &pm->lock);
+            continue;
+        }
+
+        entry->state = PROGRAM_COMPILING;
+        pthread_mutex_unlock(&pm->lock);
+
+        startProgram(entry);
+        // Make sure the program is complete before the main context uses it
+        glFinish();
+        enum ProgramState state = finishProgram(entry);
+
+        pthread_mutex_lock(&pm->lock);
+        entry->state = state;
+    }
+    pthread_mutex_unlock(&pm->lock);
+
+    eglMakeCurrent(pm->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    eglReleaseThread();
+    return NULL;
+}
+
+// Starts the worker thread with a context shared with the main context.
+// Returns 0 on success.
+static int programManagerStartWorker(struct ProgramManager *pm,
+                                     EGLConfig config, EGLContext context)
+{
+    static const EGLint workerSurfaceAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1,
+                                                  EGL_NONE};
+
+    pm->workerContext =
+        eglCreateContext(pm->display, config, context, contextAttribs);
+    if (pm->workerContext == EGL_NO_CONTEXT)
+    {
+        fprintf(stderr, "Failed to create shader worker context! Error: %s\n",
+                eglGetErrorStr());
+        return -1;
+    }
+
+    // The worker never renders. If the config has no pbuffer support (e.g. the
+    // GBM config on the Raspberry Pi 4), rely on EGL_KHR_surfaceless_context
+    // instead. Without either, there is no worker.
+    pm->workerSurface =
+        eglCreatePbufferSurface(pm->display, config, workerSurfaceAttribs);
+    if (pm->workerSurface == EGL_NO_SURFACE)
+    {
+        const char *extensions = eglQueryString(pm->display, EGL_EXTENSIONS);
+        if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+        {
+            eglDestroyContext(pm->display, pm->workerContext);
+            pm->workerContext = EGL_NO_CONTEXT;
+            return -1;
+        }
+    }
+
+    if (pthread_create(&pm->worker, NULL, programManagerWorker, pm) != 0)
+    {
+        fprintf(stderr, "Failed to create shader worker thread!\n");
+        if (pm->workerSurface != EGL_NO_SURFACE)
+            eglDestroySurface(pm->display, pm->workerSurface);
+        eglDestroyContext(pm->display, pm->workerContext);
+        pm->workerContext = EGL_NO_CONTEXT;
+        pm->workerSurface = EGL_NO_SURFACE;
+        return -1;
+    }
+
+    pm->hasWorker = 1;
+    return 0;
+}
+
+// Must be called on the render thread with the main context current.
+static void programManagerInit(struct ProgramManager *pm, EGLDisplay display,
+                               EGLConfig config, EGLContext context)
+{
+    memset(pm, 0, sizeof(*pm));
+    pm->display = display;
+    pm->api = eglQueryAPI();
+    pm->workerContext = EGL_NO_CONTEXT;
+    pm->workerSurface = EGL_NO_SURFACE;
+    pthread_mutex_init(&pm->lock, NULL);
+    pthread_cond_init(&pm->cond, NULL);
+
+    // The placeholder is tiny and is needed right away, so it is compiled
+    // synchronously.
+    struct ProgramEntry placeholder = {0};
+    placeholder.vertexCode = placeholderVertexCode;
+    placeholder.fragmentCode = placeholderFragmentCode;
+    placeholder.startTime = getTimeMs();
+    startProgram(&placeholder);
+    if (finishProgram(&placeholder) != PROGRAM_READY)
+    {
+        fprintf(stderr, "Failed to create placeholder program! Log: %s\n",
+                placeholder.log);
+    }
+    pm->placeholder = placeholder.program;
+
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    if (extensions && strstr(extensions, "GL_KHR_parallel_shader_compile"))
+    {
+        MaxShaderCompilerThreadsProc maxShaderCompilerThreads =
+            (MaxShaderCompilerThreadsProc)eglGetProcAddress(
+                "glMaxShaderCompilerThreadsKHR");
+        if (maxShaderCompilerThreads)
+        {
+            // Let the driver pick the number of threads
+            maxShaderCompilerThreads(0xFFFFFFFF);
+        }
+        pm->parallelCompile = 1;
+        printf("Shader compilation: GL_KHR_parallel_shader_compile\n");
+    }
+    else if (programManagerStartWorker(pm, config, context) == 0)
+    {
+        printf("Shader compilation: shared context worker thread\n");
+    }
+    else
+    {
+        printf("Shader compilation: synchronous\n");
+    }
+}
+
+// Queues a new program and returns its handle, or -1 if there is no space
+// left. The shader sources must stay valid until the program is done.
+static int programManagerAdd(struct ProgramManager *pm, const char *vertexCode,
+                             const char *fragmentCode)
+{
+    pthread_mutex_lock(&pm->lock);
+    if (pm->count == MAX_PROGRAMS)
+    {
+        pthread_mutex_unlock(&pm->lock);
+        fprintf(stderr, "Too many shader programs!\n");
+        return -1;
+    }
+
+    int handle = pm->count++;
+    struct ProgramEntry *entry = &pm->entries[handle];
+    memset(entry, 0, sizeof(*entry));
+    entry->vertexCode = vertexCode;
+    entry->fragmentCode = fragmentCode;
+    entry->startTime = getTimeMs();
+
+    if (pm->hasWorker && !pm->workerFailed)
+    {
+        entry->state = PROGRAM_PENDING;
+        pthread_cond_signal(&pm->cond);
+        pthread_mutex_unlock(&pm->lock);
+        return handle;
+    }
+    pthread_mutex_unlock(&pm->lock);
+
+    // Without a worker the calls are made on the render thread. With
+    // GL_KHR_parallel_shader_compile they return right away, otherwise they
+    // block just like before.
+    startProgram(entry);
+    if (pm->parallelCompile)
+        entry->state = PROGRAM_COMPILING;
+    else
+        entry->state = finishProgram(entry);
+    return handle;
+}
+
+// Returns the state of the program without blocking.
+static enum ProgramState programManagerPoll(struct ProgramManager *pm,
+                                            int handle)
+{
+    struct ProgramEntry *entry;
+    enum ProgramState state;
+    int workerFailed;
+
+    if (handle < 0 || handle >= pm->count)
+        return PROGRAM_FAILED;
+    entry = &pm->entries[handle];
+
+    pthread_mutex_lock(&pm->lock);
+    state = entry->state;
+    workerFailed = pm->workerFailed;
+    pthread_mutex_unlock(&pm->lock);
+
+    // The worker could not start, compile on the render thread instead
+    if (workerFailed && state == PROGRAM_PENDING)
+    {
+        startProgram(entry);
+        state = entry->state = finishProgram(entry);
+    }
+
+    if (pm->parallelCompile && state == PROGRAM_COMPILING)
+    {
+        GLint completed = GL_FALSE;
+        glGetProgramiv(entry->program, GL_COMPLETION_STATUS_KHR, &completed);
+        if (completed)
+            state = entry->state = finishProgram(entry);
+    }
+    return state;
+}
+
+// Returns the program to render with: the requested one if it is ready,
+// otherwise the placeholder.
+static GLuint programManagerGet(struct ProgramManager *pm, int handle)
+{
+    if (handle >= 0 && programManagerPoll(pm, handle) == PROGRAM_READY)
+        return pm->entries[handle].program;
+    return pm->placeholder;
+}
+
+// Prints the compile time and the compile log of every finished program.
+static void programManagerPrintStats(struct ProgramManager *pm)
+{
+    for (int i = 0; i < pm->count; i++)
+    {
+        struct ProgramEntry *entry = &pm->entries[i];
+        enum ProgramState state = programManagerPoll(pm, i);
+        if (state != PROGRAM_READY && state != PROGRAM_FAILED)
+        {
+            printf("Program %d: still compiling\n", i);
+            continue;
+        }
+
+        printf("Program %d: %s in %.3f ms (queued for %.3f ms)\n", i,
+               state == PROGRAM_READY ? "compiled" : "failed",
+               entry->compileTime, entry->queueTime);
+        if (entry->log[0] != '\0')
+            printf("%s\n", entry->log);
+    }
+}
+
+// Stops the worker and deletes all programs. Must be called on the render
+// thread with the main context still current.
+static void programManagerDestroy(struct ProgramManager *pm)
+{
+    if (pm->hasWorker)
+    {
+        pthread_mutex_lock(&pm->lock);
+        pm->quit = 1;
+        pthread_cond_signal(&pm->cond);
+        pthread_mutex_unlock(&pm->lock);
+        pthread_join(pm->worker, NULL);
+
+        if (pm->workerSurface != EGL_NO_SURFACE)
+            eglDestroySurface(pm->display, pm->workerSurface);
+        eglDestroyContext(pm->display, pm->workerContext);
+    }
+
+    for (int i = 0; i < pm->count; i++)
+    {
+        struct ProgramEntry *entry = &pm->entries[i];
+        if (entry->vert)
+            glDeleteShader(entry->vert);
+        if (entry->frag)
+            glDeleteShader(entry->frag);
+        if (entry->program)
+            glDeleteProgram(entry->program);
+    }
+    glDeleteProgram(pm->placeholder);
+
+    pthread_cond_destroy(&pm->cond);
+    pthread_mutex_destroy(&pm->lock);
+}
+
+// Frame pacing with EGL fence syncs.
+//
+// GL calls only queue work for the GPU, so without any limit the CPU can run
+// many frames ahead of the GPU. That adds latency and makes the driver queue
+// grow until it blocks at some random point. The frame pacer below inserts a
+// fence (EGL_KHR_fence_sync) at the end of every frame and, before starting a
+// new frame, waits for the fence of the frame submitted framesInFlight frames
+// ago. A depth of 1 fully serializes the CPU and the GPU (lowest latency), a
+// larger depth lets them overlap (higher throughput).
+//
+// For every frame the pacer records:
+// - the CPU submit time, from the start of the frame until it is flushed,
+// - the GPU time, measured with a timer query (GL_EXT_disjoint_timer_query or
+//   GL_ARB_timer_query) if the driver supports it,
+// - the fence observed latency, from the flush until the CPU saw the fence
+//   signalled. The fence is only checked at the start of a frame, so this is
+//   only accurate to one frame,
+// - the throttle time, how long the CPU waited before the frame started.
+#define MAX_FRAMES_IN_FLIGHT 8
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+#define FRAME_COUNT 100
+#define FRAME_STATS_COUNT 256
+
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT_EXT
+#define GL_QUERY_RESULT_EXT 0x8866
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+typedef void (*GenQueriesProc)(GLsizei n, GLuint *ids);
+typedef void (*DeleteQueriesProc)(GLsizei n, const GLuint *ids);
+typedef void (*BeginQueryProc)(GLenum target, GLuint id);
+typedef void (*EndQueryProc)(GLenum target);
+// GLuint64 is missing from older gl2.h headers (e.g. the one in /opt/vc)
+typedef void (*GetQueryObjectui64vProc)(GLuint id, GLenum pname,
+                                        khronos_uint64_t *params);
+
+struct FrameStats
+{
+    double cpuSubmitMs;
+    // Negative if the GPU time is not known
+    double gpuTimeMs;
+    double fenceLatencyMs;
+    double throttleMs;
+};
+
+struct FrameSlot
+{
+    EGLSyncKHR sync;
+    GLuint query;
+    int frame;
+    double submitTime;
+};
+
+struct FramePacer
+{
+    EGLDisplay display;
+    int framesInFlight;
+    int useFences;
+    int useTimerQueries;
+    int checkDisjoint;
+    int frame;
+    double frameStartTime;
+    double throttleMs;
+    struct FrameSlot slots[MAX_FRAMES_IN_FLIGHT];
+    struct FrameStats stats[FRAME_STATS_COUNT];
+    PFNEGLCREATESYNCKHRPROC createSync;
+    PFNEGLDESTROYSYNCKHRPROC destroySync;
+    PFNEGLCLIENTWAITSYNCKHRPROC clientWaitSync;
+    GenQueriesProc genQueries;
+    DeleteQueriesProc deleteQueries;
+    BeginQueryProc beginQuery;
+    EndQueryProc endQuery;
+    GetQueryObjectui64vProc getQueryObjectui64v;
+};
+
+// Loads the timer query functions, either with or without the EXT suffix.
+// Returns non-zero if all of them are available.
+static int framePacerLoadTimerQueries(struct FramePacer *fp, int ext)
+{
+    fp->genQueries = (GenQueriesProc)eglGetProcAddress(
+        ext ? "glGenQueriesEXT" : "glGenQueries");
+    fp->deleteQueries = (DeleteQueriesProc)eglGetProcAddress(
+        ext ? "glDeleteQueriesEXT" : "glDeleteQueries");
+    fp->beginQuery = (BeginQueryProc)eglGetProcAddress(
+        ext ? "glBeginQueryEXT" : "glBeginQuery");
+    fp->endQuery = (EndQueryProc)eglGetProcAddress(ext ? "glEndQueryEXT"
+                                                       : "glEndQuery");
+    fp->getQueryObjectui64v = (GetQueryObjectui64vProc)eglGetProcAddress(
+        ext ? "glGetQueryObjectui64vEXT" : "glGetQueryObjectui64v");
+    return fp->genQueries && fp->deleteQueries && fp->beginQuery &&
+           fp->endQuery && fp->getQueryObjectui64v;
+}
+
+// Returns non-zero if eglGetProcAddress can be used to load core GL
+// functions. Before EGL 1.5 this needs an extension, otherwise it may return
+// a stub that does nothing.
+static int canGetCoreProcAddress(EGLDisplay display)
+{
+    int major = 0, minor = 0;
+    const char *version = eglQueryString(display, EGL_VERSION);
+    if (version && sscanf(version, "%d.%d", &major, &minor) == 2 &&
+        (major > 1 || (major == 1 && minor >= 5)))
+        return 1;
+
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (extensions && strstr(extensions, "EGL_KHR_get_all_proc_addresses"))
+        return 1;
+
+    extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    return extensions &&
+           strstr(extensions, "EGL_KHR_client_get_all_proc_addresses");
+}
+
+// Must be called with the render context current. framesInFlight is clamped
+// to [1, MAX_FRAMES_IN_FLIGHT].
+static void framePacerInit(struct FramePacer *fp, EGLDisplay display,
+                           int framesInFlight)
+{
+    memset(fp, 0, sizeof(*fp));
+    fp->display = display;
+    fp->framesInFlight = framesInFlight;
+    if (fp->framesInFlight < 1)
+        fp->framesInFlight = 1;
+    if (fp->framesInFlight > MAX_FRAMES_IN_FLIGHT)
+        fp->framesInFlight = MAX_FRAMES_IN_FLIGHT;
+
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (extensions && strstr(extensions, "EGL_KHR_fence_sync"))
+    {
+        fp->createSync =
+            (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+        fp->destroySync =
+            (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+        fp->clientWaitSync = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress(
+            "eglClientWaitSyncKHR");
+        fp->useFences =
+            fp->createSync && fp->destroySync && fp->clientWaitSync;
+    }
+
+    // OpenGL ES has GL_EXT_disjoint_timer_query, desktop OpenGL (which is
+    // what EGL_OPENGL_API gives us on Mesa) has GL_ARB_timer_query.
+    const char *glExtensions = (const char *)glGetString(GL_EXTENSIONS);
+    if (fp->useFences && glExtensions)
+    {
+        if (strstr(glExtensions, "GL_EXT_disjoint_timer_query"))
+        {
+            fp->useTimerQueries = framePacerLoadTimerQueries(fp, 1);
+            fp->checkDisjoint = 1;
+        }
+        else if (strstr(glExtensions, "GL_ARB_timer_query") &&
+                 canGetCoreProcAddress(display))
+        {
+            fp->useTimerQueries = framePacerLoadTimerQueries(fp, 0);
+        }
+    }
+
+    if (fp->useTimerQueries)
+    {
+        for (int i = 0; i < fp->framesInFlight; i++)
+            fp->genQueries(1, &fp->slots[i].query);
+    }
+
+    if (fp->useFences)
+    {
+        printf("Frame pacing: EGL_KHR_fence_sync, %d frame(s) in flight%s\n",
+               fp->framesInFlight,
+               fp->useTimerQueries ? ", GPU timer queries" : "");
+    }
+    else
+    {
+        // Without fences the only option is to wait for every frame
+        fp->framesInFlight = 1;
+        printf("Frame pacing: glFinish, 1 frame in flight\n");
+    }
+}
+
+// Records the completion of the frame in the slot and releases its fence.
+// The fence must already be signalled, so the query result is available.
+static void framePacerRetire(struct FramePacer *fp, struct FrameSlot *slot)
+{
+    struct FrameStats *stats = &fp->stats[slot->frame % FRAME_STATS_COUNT];
+    stats->fenceLatencyMs = getTimeMs() - slot->submitTime;
+
+    if (fp->useTimerQueries)
+    {
+        khronos_uint64_t elapsed = 0;
+        GLint disjoint = 0;
+        fp->getQueryObjectui64v(slot->query, GL_QUERY_RESULT_EXT, &elapsed);
+        if (fp->checkDisjoint)
+            glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        // A disjoint operation (e.g. a frequency change) makes the result
+        // meaningless
+        if (!disjoint)
+            stats->gpuTimeMs = elapsed / 1000000.0;
+    }
+
+    fp->destroySync(fp->display, slot->sync);
+    slot->sync = EGL_NO_SYNC_KHR;
+}
+
+// Call before issuing any GL calls of a new frame. Blocks if there are
+// already framesInFlight frames queued on the GPU.
+static void framePacerBeginFrame(struct FramePacer *fp)
+{
+    fp->throttleMs = 0.0;
+
+    if (fp->useFences)
+    {
+        // Retire every frame the GPU has already finished, without blocking.
+        for (int i = 0; i < fp->framesInFlight; i++)
+        {
+            struct FrameSlot *slot = &fp->slots[i];
+            if (slot->sync != EGL_NO_SYNC_KHR &&
+                fp->clientWaitSync(fp->display, slot->sync, 0, 0) ==
+                    EGL_CONDITION_SATISFIED_KHR)
+            {
+                framePacerRetire(fp, slot);
+            }
+        }
+
+        // The slot of this frame is still taken by the frame submitted
+        // framesInFlight frames ago. Wait for it.
+        struct FrameSlot *slot = &fp->slots[fp->frame % fp->framesInFlight];
+        double waitStart = getTimeMs();
+        if (slot->sync != EGL_NO_SYNC_KHR)
+        {
+            if (fp->clientWaitSync(fp->display, slot->sync,
+                                   EGL_SYNC_FLUSH_COMMANDS_BIT_KHR,
+                                   EGL_FOREVER_KHR) == EGL_FALSE)
+            {
+                fprintf(stderr, "Failed to wait for frame fence! Error: %s\n",
+                        eglGetErrorStr());
+            }
+            framePacerRetire(fp, slot);
+        }
+        fp->throttleMs = getTimeMs() - waitStart;
+
+        if (fp->useTimerQueries)
+            fp->beginQuery(GL_TIME_ELAPSED_EXT, slot->query);
+    }
+
+    fp->frameStartTime = getTimeMs();
+}
+
+// Call after the last GL call of the frame (and after eglSwapBuffers, if
+// any). Submits the frame to the GPU without waiting for it.
+static void framePacerEndFrame(struct FramePacer *fp)
+{
+    struct FrameStats *stats = &fp->stats[fp->frame % FRAME_STATS_COUNT];
+    stats->throttleMs = fp->throttleMs;
+    stats->gpuTimeMs = -1.0;
+    stats->fenceLatencyMs = 0.0;
+
+    if (fp->useFences)
+    {
+        struct FrameSlot *slot = &fp->slots[fp->frame % fp->framesInFlight];
+        if (fp->useTimerQueries)
+            fp->endQuery(GL_TIME_ELAPSED_EXT);
+        slot->sync = fp->createSync(fp->display, EGL_SYNC_FENCE_KHR, NULL);
+        if (slot->sync == EGL_NO_SYNC_KHR)
+        {
+            fprintf(stderr, "Failed to create frame fence! Error: %s\n",
+                    eglGetErrorStr());
+        }
+        slot->frame = fp->frame;
+        // Make sure the frame actually reaches the GPU
+        glFlush();
+        slot->submitTime = getTimeMs();
+        stats->cpuSubmitMs = slot->submitTime - fp->frameStartTime;
+    }
+    else
+    {
+        double submitTime = getTimeMs();
+        stats->cpuSubmitMs = submitTime - fp->frameStartTime;
+        glFinish();
+        stats->fenceLatencyMs = getTimeMs() - submitTime;
+    }
+
+    fp->frame++;
+}
+
+// Waits for all frames in flight and releases their fences.
+static void framePacerFinish(struct FramePacer *fp)
+{
+    if (!fp->useFences)
+        return;
+
+    // Retire the frames in submission order
+    for (int frame = fp->frame - fp->framesInFlight; frame < fp->frame;
+         frame++)
+    {
+        if (frame < 0)
+            continue;
+
+        struct FrameSlot *slot = &fp->slots[frame % fp->framesInFlight];
+        if (slot->sync == EGL_NO_SYNC_KHR)
+            continue;
+
+        fp->clientWaitSync(fp->display, slot->sync,
+                           EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+        framePacerRetire(fp, slot);
+    }
+}
+
+// Waits for all frames in flight and starts counting frames from zero, so
+// that the stats only cover the frames rendered from now on.
+static void framePacerReset(struct FramePacer *fp)
+{
+    framePacerFinish(fp);
+    fp->frame = 0;
+    memset(fp->stats, 0, sizeof(fp->stats));
+}
+
+// Releases the timer queries. Must be called with the render context current.
+static void framePacerDestroy(struct FramePacer *fp)
+{
+    framePacerFinish(fp);
+    if (fp->useTimerQueries)
+    {
+        for (int i = 0; i < fp->framesInFlight; i++)
+            fp->deleteQueries(1, &fp->slots[i].query);
+    }
+}
+
+// Prints the average and the worst frame timings of the recorded frames.
+// Call after framePacerFinish() so that every frame has completed.
+static void framePacerPrintStats(struct FramePacer *fp)
+{
+    int count = fp->frame < FRAME_STATS_COUNT ? fp->frame : FRAME_STATS_COUNT;
+    int gpuCount = 0;
+    double cpuSum = 0.0, gpuSum = 0.0, fenceSum = 0.0, throttleSum = 0.0;
+    double cpuMax = 0.0, gpuMax = 0.0, fenceMax = 0.0, throttleMax = 0.0;
+
+    if (count == 0)
+        return;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct FrameStats *stats = &fp->stats[i];
+        cpuSum += stats->cpuSubmitMs;
+        fenceSum += stats->fenceLatencyMs;
+        throttleSum += stats->throttleMs;
+        if (stats->cpuSubmitMs > cpuMax)
+            cpuMax = stats->cpuSubmitMs;
+        if (stats->fenceLatencyMs > fenceMax)
+            fenceMax = stats->fenceLatencyMs;
+        if (stats->throttleMs > throttleMax)
+            throttleMax = stats->throttleMs;
+
+        if (stats->gpuTimeMs >= 0.0)
+        {
+            gpuSum += stats->gpuTimeMs;
+            gpuCount++;
+            if (stats->gpuTimeMs > gpuMax)
+                gpuMax = stats->gpuTimeMs;
+        }
+    }
+
+    printf("Frames: %d, frames in flight: %d\n", fp->frame,
+           fp->framesInFlight);
+    printf("CPU submit:    avg %.3f ms, max %.3f ms\n", cpuSum / count,
+           cpuMax);
+    if (gpuCount > 0)
+    {
+        printf("GPU time:      avg %.3f ms, max %.3f ms\n", gpuSum / gpuCount,
+               gpuMax);
+    }
+    else
+    {
+        printf("GPU time:      not available\n");
+    }
+    printf("Fence latency: avg %.3f ms, max %.3f ms (accurate to one frame)\n",
+           fenceSum / count, fenceMax);
+    printf("CPU throttle:  avg %.3f ms, max %.3f ms\n", throttleSum / count,
+           throttleMax);
+}
+
+int main(int argc, char **argv)
 {
     EGLDisplay display;
     int major, minor;
     int desiredWidth, desiredHeight;
-    GLuint program, vert, frag, vbo;
+    GLuint program, vbo;
     GLint posLoc, colorLoc, result;
 
     if ((display = eglGetDisplay(EGL_DEFAULT_DISPLAY)) == EGL_NO_DISPLAY)
@@ -195,21 +1017,13 @@ int main(int argv, char **argc)
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Create a shader program
-    // NO ERRRO CHECKING IS DONE! (for the purpose of this example)
-    // Read an OpenGL tutorial to properly implement shader creation
-    program = glCreateProgram();
-    glUseProgram(program);
-    vert = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vert, 1, &vertexShaderCode, NULL);
-    glCompileShader(vert);
-    frag = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(frag, 1, &fragmentShaderCode, NULL);
-    glCompileShader(frag);
-    glAttachShader(program, frag);
-    glAttachShader(program, vert);
-    glLinkProgram(program);
-    glUseProgram(program);
+    // Create the shader program in the background
+    // The program manager compiles it off the render thread, see
+    // ProgramManager above for details.
+    struct ProgramManager programs;
+    programManagerInit(&programs, display, config, context);
+    int triangleProgram =
+        programManagerAdd(&programs, vertexShaderCode, fragmentShaderCode);
 
     // Create Vertex Buffer Object
     // Again, NO ERRRO CHECKING IS DONE! (for the purpose of this example)
@@ -217,13 +1031,9 @@ int main(int argv, char **argc)
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
     glBufferData(GL_ARRAY_BUFFER, 9 * sizeof(float), vertices, GL_STATIC_DRAW);
 
-    // Get vertex attribute and uniform locations
-    posLoc = glGetAttribLocation(program, "pos");
-    colorLoc = glGetUniformLocation(program, "color");
-
-    // Set the desired color of the triangle to pink
-    // 100% red, 0% green, 50% blue, 100% alpha
-    glUniform4f(colorLoc, 1.0, 0.0f, 0.5, 1.0);
+    // The vertex attribute location is bound by the program manager, so it
+    // is the same for the placeholder and the triangle program.
+    posLoc = POS_ATTRIB_LOCATION;
 
     // Set our vertex data
     glEnableVertexAttribArray(posLoc);
@@ -231,8 +1041,59 @@ int main(int argv, char **argc)
     glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float),
                           (void *)0);
 
-    // Render a triangle consisting of 3 vertices:
-    glDrawArrays(GL_TRIANGLES, 0, 3);
+    // Limit how far the CPU can get ahead of the GPU. The number of frames in
+    // flight can be passed as the first command line argument.
+    struct FramePacer pacer;
+    framePacerInit(&pacer, display,
+                   argc > 1 ? atoi(argv[1]) : DEFAULT_FRAMES_IN_FLIGHT);
+
+    // Keep rendering while the triangle program is being compiled. Until it
+    // is ready, the placeholder program is used instead.
+    enum ProgramState state;
+    int placeholderFrames = 0;
+    while ((state = programManagerPoll(&programs, triangleProgram)) ==
+               PROGRAM_PENDING ||
+           state == PROGRAM_COMPILING)
+    {
+        framePacerBeginFrame(&pacer);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glUseProgram(programManagerGet(&programs, triangleProgram));
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        framePacerEndFrame(&pacer);
+        placeholderFrames++;
+    }
+
+    printf("Rendered %d frames with the placeholder program\n",
+           placeholderFrames);
+    programManagerPrintStats(&programs);
+
+    // If the program has failed to compile, this is the placeholder
+    program = programManagerGet(&programs, triangleProgram);
+    glUseProgram(program);
+
+    // Get uniform locations
+    colorLoc = glGetUniformLocation(program, "color");
+
+    // Set the desired color of the triangle to pink
+    // 100% red, 0% green, 50% blue, 100% alpha
+    glUniform4f(colorLoc, 1.0, 0.0f, 0.5, 1.0);
+
+    // Only the frames below are included in the stats
+    framePacerReset(&pacer);
+
+    // Render a triangle consisting of 3 vertices, FRAME_COUNT times to
+    // simulate a continuous render loop
+    for (int i = 0; i < FRAME_COUNT; i++)
+    {
+        framePacerBeginFrame(&pacer);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        framePacerEndFrame(&pacer);
+    }
+
+    // Wait for the GPU to finish all frames in flight
+    framePacerFinish(&pacer);
+    framePacerPrintStats(&pacer);
 
     // Create buffer to hold entire front buffer pixels
     // We multiply width and height by 3 to because we use RGB!
@@ -259,6 +1120,8 @@ int main(int argv, char **argc)
     free(buffer);
 
     // Cleanup
+    framePacerDestroy(&pacer);
+    programManagerDestroy(&programs);
     eglDestroyContext(display, context);
     eglDestroySurface(display, surface);
     eglTerminate(display);